@@ -0,0 +1,26 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Internet checksum helpers. Each call to checksum_add must start at an even
+// offset within the checksummed data. The result of checksum_finish is in
+// network byte order, so it can be written directly into a header.
+inline uint32_t checksum_add(uint32_t sum, const void* data, size_t size) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+  for (size_t x = 0; x + 1 < size; x += 2) {
+    sum += (bytes[x] << 8) | bytes[x + 1];
+  }
+  if (size & 1) {
+    sum += bytes[size - 1] << 8;
+  }
+  return sum;
+}
+
+inline uint16_t checksum_finish(uint32_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return htons(~sum & 0xFFFF);
+}
@@ -0,0 +1,490 @@
+#include "LocalResponder.hh"
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "Checksum.hh"
+
+using namespace std;
+
+
+
+struct arp_ipv4 {
+  uint16_t hardware_type;
+  uint16_t protocol_type;
+  uint8_t hwaddr_len;
+  uint8_t paddr_len;
+  uint16_t operation;
+  uint8_t sender_hwaddr[6];
+  uint8_t sender_paddr[4];
+  uint8_t target_hwaddr[6];
+  uint8_t target_paddr[4];
+};
+
+struct dhcp_header {
+  uint8_t op;
+  uint8_t htype;
+  uint8_t hlen;
+  uint8_t hops;
+  uint32_t xid;
+  uint16_t secs;
+  uint16_t flags;
+  uint8_t ciaddr[4];
+  uint8_t yiaddr[4];
+  uint8_t siaddr[4];
+  uint8_t giaddr[4];
+  uint8_t chaddr[16];
+  uint8_t sname[64];
+  uint8_t file[128];
+  uint32_t magic;
+};
+
+static const uint32_t DHCP_MAGIC = 0x63825363;
+static const uint16_t DHCP_FLAG_BROADCAST = 0x8000;
+// How long an offered address is held for a client that hasn't requested it
+static const uint32_t DHCP_OFFER_SECONDS = 60;
+// Some clients ignore BOOTP messages shorter than the original BOOTP size
+static const size_t DHCP_MIN_MESSAGE_SIZE = 300;
+
+enum DHCPMessageType {
+  DHCPDISCOVER = 1,
+  DHCPOFFER = 2,
+  DHCPREQUEST = 3,
+  DHCPDECLINE = 4,
+  DHCPACK = 5,
+  DHCPNAK = 6,
+  DHCPRELEASE = 7,
+  DHCPINFORM = 8,
+};
+
+static uint32_t load_be32(const uint8_t* data) {
+  return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static void store_be32(uint8_t* data, uint32_t value) {
+  data[0] = value >> 24;
+  data[1] = value >> 16;
+  data[2] = value >> 8;
+  data[3] = value;
+}
+
+
+
+LocalResponder::LocalResponder(
+    const uint8_t mac_address[6],
+    const uint8_t ip_address[4],
+    bool respond_arp,
+    bool respond_ndp,
+    const uint8_t* dhcp_pool_start,
+    size_t dhcp_pool_size,
+    const uint8_t* dhcp_subnet_mask,
+    uint32_t dhcp_lease_seconds)
+  : respond_arp(respond_arp),
+    respond_ndp(respond_ndp),
+    dhcp_pool_start(dhcp_pool_start ? load_be32(dhcp_pool_start) : 0),
+    dhcp_subnet_mask(dhcp_subnet_mask ? load_be32(dhcp_subnet_mask) : 0xFFFFFF00),
+    dhcp_lease_seconds(dhcp_lease_seconds),
+    leases(dhcp_pool_start ? dhcp_pool_size : 0, Lease{0, {0, 0, 0, 0, 0, 0}, false}) {
+
+  memcpy(this->mac_address, mac_address, 6);
+  memcpy(this->ip_address, ip_address, 4);
+
+  // Never assign the host's own address, even if it's inside the pool
+  uint32_t host_index = load_be32(this->ip_address) - this->dhcp_pool_start;
+  if (host_index < this->leases.size()) {
+    this->leases[host_index].reserved = true;
+  }
+}
+
+bool LocalResponder::is_enabled() const {
+  return this->respond_arp || this->respond_ndp || !this->leases.empty();
+}
+
+void LocalResponder::set_ipv6_addresses(const vector<in6_addr>& addresses) {
+  this->ipv6_addresses = addresses;
+}
+
+bool LocalResponder::handle_frame(const void* data, size_t size, string& response) {
+  response.clear();
+  if (size < sizeof(ether_header)) {
+    return false;
+  }
+
+  const ether_header* eth = reinterpret_cast<const ether_header*>(data);
+  switch (ntohs(eth->ether_type)) {
+    case 0x0806: // ARP
+      return this->respond_arp && this->handle_arp(data, size, response);
+    case 0x86DD: // IPv6
+      return this->respond_ndp && this->handle_ndp(data, size, response);
+    case 0x0800: // IPv4
+      return !this->leases.empty() && this->handle_dhcp(data, size, response);
+  }
+  return false;
+}
+
+bool LocalResponder::handle_arp(const void* data, size_t size, string& response) {
+  if (size < sizeof(ether_header) + sizeof(arp_ipv4)) {
+    return false;
+  }
+  const arp_ipv4* req = reinterpret_cast<const arp_ipv4*>(
+      reinterpret_cast<const ether_header*>(data) + 1);
+  if ((ntohs(req->hardware_type) != 1) ||
+      (ntohs(req->protocol_type) != 0x0800) ||
+      (req->hwaddr_len != 6) ||
+      (req->paddr_len != 4) ||
+      (ntohs(req->operation) != 1) ||
+      memcmp(req->target_paddr, this->ip_address, 4)) {
+    return false;
+  }
+
+  response.resize(sizeof(ether_header) + sizeof(arp_ipv4));
+  ether_header* resp_eth = reinterpret_cast<ether_header*>(response.data());
+  memcpy(resp_eth->ether_dhost, req->sender_hwaddr, 6);
+  memcpy(resp_eth->ether_shost, this->mac_address, 6);
+  resp_eth->ether_type = htons(0x0806);
+
+  arp_ipv4* resp = reinterpret_cast<arp_ipv4*>(resp_eth + 1);
+  resp->hardware_type = req->hardware_type;
+  resp->protocol_type = req->protocol_type;
+  resp->hwaddr_len = 6;
+  resp->paddr_len = 4;
+  resp->operation = htons(2);
+  memcpy(resp->sender_hwaddr, this->mac_address, 6);
+  memcpy(resp->sender_paddr, this->ip_address, 4);
+  memcpy(resp->target_hwaddr, req->sender_hwaddr, 6);
+  memcpy(resp->target_paddr, req->sender_paddr, 4);
+  return true;
+}
+
+bool LocalResponder::handle_ndp(const void* data, size_t size, string& response) {
+  if (size < sizeof(ether_header) + sizeof(ip6_hdr) + sizeof(nd_neighbor_solicit)) {
+    return false;
+  }
+  const ether_header* eth = reinterpret_cast<const ether_header*>(data);
+  const ip6_hdr* ip6 = reinterpret_cast<const ip6_hdr*>(eth + 1);
+  size_t icmp_size = ntohs(ip6->ip6_plen);
+  if ((ip6->ip6_nxt != IPPROTO_ICMPV6) ||
+      (ip6->ip6_hlim != 255) ||
+      (icmp_size < sizeof(nd_neighbor_solicit)) ||
+      (sizeof(ether_header) + sizeof(ip6_hdr) + icmp_size > size)) {
+    return false;
+  }
+  const nd_neighbor_solicit* ns = reinterpret_cast<const nd_neighbor_solicit*>(ip6 + 1);
+  if ((ns->nd_ns_type != ND_NEIGHBOR_SOLICIT) || (ns->nd_ns_code != 0) ||
+      none_of(this->ipv6_addresses.begin(), this->ipv6_addresses.end(), [&](const in6_addr& addr) {
+        return !memcmp(&addr, &ns->nd_ns_target, sizeof(addr));
+      })) {
+    return false;
+  }
+
+  // If the source is unspecified, this is duplicate address detection, and the
+  // response has to go to all nodes
+  static const uint8_t unspecified_address[16] = {0};
+  static const uint8_t all_nodes_address[16] = {
+      0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01};
+  static const uint8_t all_nodes_mac_address[6] = {0x33, 0x33, 0, 0, 0, 0x01};
+  bool is_dad = !memcmp(&ip6->ip6_src, unspecified_address, 16);
+
+  // The response has one option: the target link-layer address (8 bytes)
+  size_t resp_icmp_size = sizeof(nd_neighbor_advert) + 8;
+  response.resize(sizeof(ether_header) + sizeof(ip6_hdr) + resp_icmp_size);
+  ether_header* resp_eth = reinterpret_cast<ether_header*>(response.data());
+  memcpy(resp_eth->ether_dhost, is_dad ? all_nodes_mac_address : eth->ether_shost, 6);
+  memcpy(resp_eth->ether_shost, this->mac_address, 6);
+  resp_eth->ether_type = htons(0x86DD);
+
+  ip6_hdr* resp_ip6 = reinterpret_cast<ip6_hdr*>(resp_eth + 1);
+  resp_ip6->ip6_flow = htonl(0x60000000);
+  resp_ip6->ip6_plen = htons(resp_icmp_size);
+  resp_ip6->ip6_nxt = IPPROTO_ICMPV6;
+  resp_ip6->ip6_hlim = 255;
+  memcpy(&resp_ip6->ip6_src, &ns->nd_ns_target, 16);
+  memcpy(&resp_ip6->ip6_dst, is_dad ? all_nodes_address : reinterpret_cast<const uint8_t*>(&ip6->ip6_src), 16);
+
+  nd_neighbor_advert* na = reinterpret_cast<nd_neighbor_advert*>(resp_ip6 + 1);
+  na->nd_na_type = ND_NEIGHBOR_ADVERT;
+  na->nd_na_code = 0;
+  na->nd_na_flags_reserved = ND_NA_FLAG_OVERRIDE | (is_dad ? 0 : ND_NA_FLAG_SOLICITED);
+  memcpy(&na->nd_na_target, &ns->nd_ns_target, 16);
+  uint8_t* option = reinterpret_cast<uint8_t*>(na + 1);
+  option[0] = ND_OPT_TARGET_LINKADDR;
+  option[1] = 1; // in units of 8 bytes
+  memcpy(&option[2], this->mac_address, 6);
+
+  uint8_t pseudo_header_tail[8] = {0, 0,
+      static_cast<uint8_t>(resp_icmp_size >> 8), static_cast<uint8_t>(resp_icmp_size),
+      0, 0, 0, IPPROTO_ICMPV6};
+  uint32_t sum = checksum_add(0, &resp_ip6->ip6_src, 16);
+  sum = checksum_add(sum, &resp_ip6->ip6_dst, 16);
+  sum = checksum_add(sum, pseudo_header_tail, sizeof(pseudo_header_tail));
+  na->nd_na_cksum = 0;
+  na->nd_na_cksum = checksum_finish(checksum_add(sum, na, resp_icmp_size));
+  return true;
+}
+
+ssize_t LocalResponder::find_lease(const uint8_t* mac_address,
+    uint32_t requested_address, uint32_t now) const {
+  // Prefer the client's existing lease, then the address it asked for, then
+  // any free address
+  ssize_t free_index = -1;
+  for (size_t x = 0; x < this->leases.size(); x++) {
+    if (this->leases[x].reserved) {
+      continue;
+    }
+    if (!memcmp(this->leases[x].mac_address, mac_address, 6)) {
+      return x;
+    }
+    if ((free_index < 0) && (this->leases[x].expiration <= now)) {
+      free_index = x;
+    }
+  }
+  size_t requested_index = requested_address - this->dhcp_pool_start;
+  if ((requested_index < this->leases.size()) &&
+      !this->leases[requested_index].reserved &&
+      (this->leases[requested_index].expiration <= now)) {
+    return requested_index;
+  }
+  return free_index;
+}
+
+bool LocalResponder::handle_dhcp(const void* data, size_t size, string& response) {
+  if (size < sizeof(ether_header) + sizeof(ip)) {
+    return false;
+  }
+  const ip* ip4 = reinterpret_cast<const ip*>(
+      reinterpret_cast<const ether_header*>(data) + 1);
+  size_t ip_header_size = ip4->ip_hl * 4;
+  size_t ip_size = ntohs(ip4->ip_len);
+  if ((ip4->ip_p != IPPROTO_UDP) ||
+      (ntohs(ip4->ip_off) & (IP_MF | IP_OFFMASK)) ||
+      (ip_header_size < sizeof(ip)) ||
+      (sizeof(ether_header) + ip_size > size) ||
+      (ip_header_size + sizeof(udphdr) + sizeof(dhcp_header) > ip_size)) {
+    return false;
+  }
+  const udphdr* udp = reinterpret_cast<const udphdr*>(
+      reinterpret_cast<const uint8_t*>(ip4) + ip_header_size);
+  if ((ntohs(udp->uh_sport) != 68) || (ntohs(udp->uh_dport) != 67)) {
+    return false;
+  }
+
+  dhcp_header req;
+  memcpy(&req, udp + 1, sizeof(req));
+  static const uint8_t zero_mac_address[6] = {0, 0, 0, 0, 0, 0};
+  if ((req.op != 1) || (req.htype != 1) || (req.hlen != 6) ||
+      (ntohl(req.magic) != DHCP_MAGIC) ||
+      !memcmp(req.chaddr, zero_mac_address, 6)) {
+    return false;
+  }
+
+  const uint8_t* options = reinterpret_cast<const uint8_t*>(udp + 1) + sizeof(dhcp_header);
+  size_t options_size = ip_size - ip_header_size - sizeof(udphdr) - sizeof(dhcp_header);
+  uint8_t message_type = 0;
+  uint32_t requested_address = 0;
+  uint32_t server_id = 0;
+  for (size_t offset = 0; offset < options_size;) {
+    uint8_t code = options[offset];
+    if (code == 0) { // pad
+      offset++;
+      continue;
+    }
+    if ((code == 255) || (offset + 2 > options_size)) { // end
+      break;
+    }
+    uint8_t length = options[offset + 1];
+    if (offset + 2 + length > options_size) {
+      break;
+    }
+    const uint8_t* value = &options[offset + 2];
+    if ((code == 53) && (length == 1)) {
+      message_type = value[0];
+    } else if ((code == 50) && (length == 4)) {
+      requested_address = load_be32(value);
+    } else if ((code == 54) && (length == 4)) {
+      server_id = load_be32(value);
+    }
+    offset += 2 + length;
+  }
+
+  // If the client chose a different server, let that server handle it
+  uint32_t host_address = load_be32(this->ip_address);
+  if (server_id && (server_id != host_address)) {
+    return false;
+  }
+
+  uint32_t now = time(nullptr);
+  uint32_t client_address = load_be32(req.ciaddr);
+  uint32_t assigned_address = 0;
+  uint8_t response_type = 0;
+  switch (message_type) {
+    case DHCPDISCOVER: {
+      ssize_t index = this->find_lease(req.chaddr, requested_address, now);
+      if (index < 0) {
+        return false; // pool is exhausted
+      }
+      Lease& lease = this->leases[index];
+      if (memcmp(lease.mac_address, req.chaddr, 6)) {
+        memcpy(lease.mac_address, req.chaddr, 6);
+        lease.expiration = 0;
+      }
+      lease.expiration = max<uint32_t>(lease.expiration, now + DHCP_OFFER_SECONDS);
+      assigned_address = this->dhcp_pool_start + index;
+      response_type = DHCPOFFER;
+      break;
+    }
+
+    case DHCPREQUEST: {
+      uint32_t address = requested_address ? requested_address : client_address;
+      size_t index = address - this->dhcp_pool_start;
+      if ((index < this->leases.size()) && !this->leases[index].reserved &&
+          ((this->leases[index].expiration <= now) ||
+           !memcmp(this->leases[index].mac_address, req.chaddr, 6))) {
+        // A client holds at most one lease, so release any other address it
+        // had (for example, one offered earlier that it didn't take)
+        for (size_t x = 0; x < this->leases.size(); x++) {
+          if ((x != index) && !this->leases[x].reserved &&
+              !memcmp(this->leases[x].mac_address, req.chaddr, 6)) {
+            memset(this->leases[x].mac_address, 0, 6);
+            this->leases[x].expiration = 0;
+          }
+        }
+        Lease& lease = this->leases[index];
+        memcpy(lease.mac_address, req.chaddr, 6);
+        lease.expiration = now + this->dhcp_lease_seconds;
+        assigned_address = address;
+        response_type = DHCPACK;
+      } else {
+        response_type = DHCPNAK;
+      }
+      break;
+    }
+
+    case DHCPDECLINE: {
+      // Someone else is using the address; don't assign it for a while
+      size_t index = requested_address - this->dhcp_pool_start;
+      if ((index < this->leases.size()) && !this->leases[index].reserved &&
+          !memcmp(this->leases[index].mac_address, req.chaddr, 6)) {
+        memset(this->leases[index].mac_address, 0, 6);
+        this->leases[index].expiration = now + this->dhcp_lease_seconds;
+      }
+      return true;
+    }
+
+    case DHCPRELEASE: {
+      // Leave the MAC address in place, so the client gets the same address
+      // back if it asks again
+      size_t index = client_address - this->dhcp_pool_start;
+      if ((index < this->leases.size()) && !this->leases[index].reserved &&
+          !memcmp(this->leases[index].mac_address, req.chaddr, 6)) {
+        this->leases[index].expiration = now;
+      }
+      return true;
+    }
+
+    case DHCPINFORM:
+      response_type = DHCPACK;
+      break;
+
+    default:
+      return false;
+  }
+
+  dhcp_header resp;
+  memset(&resp, 0, sizeof(resp));
+  resp.op = 2;
+  resp.htype = 1;
+  resp.hlen = 6;
+  resp.xid = req.xid;
+  resp.flags = req.flags;
+  if (message_type == DHCPINFORM) {
+    memcpy(resp.ciaddr, req.ciaddr, 4);
+  }
+  store_be32(resp.yiaddr, assigned_address);
+  memcpy(resp.giaddr, req.giaddr, 4);
+  memcpy(resp.chaddr, req.chaddr, sizeof(resp.chaddr));
+  resp.magic = htonl(DHCP_MAGIC);
+
+  string resp_options;
+  auto add_option = [&](uint8_t code, const void* value, uint8_t size) {
+    resp_options.push_back(static_cast<char>(code));
+    resp_options.push_back(static_cast<char>(size));
+    resp_options.append(reinterpret_cast<const char*>(value), size);
+  };
+  add_option(53, &response_type, 1);
+  add_option(54, this->ip_address, 4);
+  if (response_type != DHCPNAK) {
+    uint8_t value[4];
+    store_be32(value, this->dhcp_subnet_mask);
+    add_option(1, value, 4); // subnet mask
+    add_option(3, this->ip_address, 4); // router
+    add_option(6, this->ip_address, 4); // DNS server
+    if (message_type != DHCPINFORM) {
+      store_be32(value, this->dhcp_lease_seconds);
+      add_option(51, value, 4); // lease time
+    }
+  }
+  resp_options.push_back(static_cast<char>(255)); // end
+  if (sizeof(dhcp_header) + resp_options.size() < DHCP_MIN_MESSAGE_SIZE) {
+    resp_options.resize(DHCP_MIN_MESSAGE_SIZE - sizeof(dhcp_header), '\0');
+  }
+
+  // Clients that don't have an address yet can't receive unicast packets, so
+  // the response is broadcast unless the client already has an address
+  bool broadcast = (response_type == DHCPNAK) ||
+      (ntohs(req.flags) & DHCP_FLAG_BROADCAST) ||
+      !client_address;
+  uint32_t dest_address = broadcast ? 0xFFFFFFFF :
+      ((message_type == DHCPINFORM) ? client_address : assigned_address);
+
+  size_t udp_size = sizeof(udphdr) + sizeof(dhcp_header) + resp_options.size();
+  response.resize(sizeof(ether_header) + sizeof(ip) + udp_size);
+  ether_header* resp_eth = reinterpret_cast<ether_header*>(response.data());
+  memset(resp_eth->ether_dhost, 0xFF, 6);
+  if (!broadcast) {
+    memcpy(resp_eth->ether_dhost, req.chaddr, 6);
+  }
+  memcpy(resp_eth->ether_shost, this->mac_address, 6);
+  resp_eth->ether_type = htons(0x0800);
+
+  ip* resp_ip4 = reinterpret_cast<ip*>(resp_eth + 1);
+  memset(resp_ip4, 0, sizeof(ip));
+  resp_ip4->ip_v = 4;
+  resp_ip4->ip_hl = sizeof(ip) / 4;
+  resp_ip4->ip_len = htons(sizeof(ip) + udp_size);
+  resp_ip4->ip_ttl = 64;
+  resp_ip4->ip_p = IPPROTO_UDP;
+  memcpy(&resp_ip4->ip_src, this->ip_address, 4);
+  uint8_t dest_address_bytes[4];
+  store_be32(dest_address_bytes, dest_address);
+  memcpy(&resp_ip4->ip_dst, dest_address_bytes, 4);
+  resp_ip4->ip_sum = checksum_finish(checksum_add(0, resp_ip4, sizeof(ip)));
+
+  udphdr* resp_udp = reinterpret_cast<udphdr*>(resp_ip4 + 1);
+  resp_udp->uh_sport = htons(67);
+  resp_udp->uh_dport = htons(68);
+  resp_udp->uh_ulen = htons(udp_size);
+  resp_udp->uh_sum = 0;
+  uint8_t* resp_payload = reinterpret_cast<uint8_t*>(resp_udp + 1);
+  memcpy(resp_payload, &resp, sizeof(resp));
+  memcpy(resp_payload + sizeof(resp), resp_options.data(), resp_options.size());
+
+  uint8_t pseudo_header_tail[4] = {0, IPPROTO_UDP,
+      static_cast<uint8_t>(udp_size >> 8), static_cast<uint8_t>(udp_size)};
+  uint32_t sum = checksum_add(0, &resp_ip4->ip_src, 4);
+  sum = checksum_add(sum, &resp_ip4->ip_dst, 4);
+  sum = checksum_add(sum, pseudo_header_tail, sizeof(pseudo_header_tail));
+  resp_udp->uh_sum = checksum_finish(checksum_add(sum, resp_udp, udp_size));
+  if (resp_udp->uh_sum == 0) {
+    resp_udp->uh_sum = 0xFFFF; // 0 means no checksum in UDP
+  }
+  return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+// Answers some common link-setup requests from the client directly, instead of
+// sending them through the interface to the host's network stack. This can
+// answer ARP requests for the host's IPv4 address, IPv6 neighbor solicitations
+// for the host's IPv6 addresses, and DHCPv4 requests (assigning addresses from
+// a pool, with the host as the router and DNS server).
+class LocalResponder {
+public:
+  // To disable DHCP, pass nullptr for dhcp_pool_start or 0 for dhcp_pool_size.
+  LocalResponder(
+      const uint8_t mac_address[6],
+      const uint8_t ip_address[4],
+      bool respond_arp = true,
+      bool respond_ndp = true,
+      const uint8_t* dhcp_pool_start = nullptr,
+      size_t dhcp_pool_size = 0,
+      const uint8_t* dhcp_subnet_mask = nullptr,
+      uint32_t dhcp_lease_seconds = 86400);
+  ~LocalResponder() = default;
+
+  // Returns true if any kind of request would be answered.
+  bool is_enabled() const;
+
+  // Sets the IPv6 addresses that neighbor solicitations are answered for. These
+  // should be the host-side interface's actual addresses (see
+  // MacOSNetworkTapInterface::get_ipv6_addresses); no solicitations are
+  // answered until this is called.
+  void set_ipv6_addresses(const std::vector<in6_addr>& addresses);
+
+  // Examines a frame sent by the client. If it's a request that this object
+  // handles, returns true and sets response to the frame that should be sent
+  // back to the client (response is empty if no reply is needed); in this case
+  // the frame should not be sent to the interface. Returns false for all other
+  // frames.
+  bool handle_frame(const void* data, size_t size, std::string& response);
+
+protected:
+  // There is one of these for each address in the DHCP pool, so the address
+  // isn't stored; it's implied by the entry's index
+  struct Lease {
+    uint32_t expiration; // time() value; 0 if never assigned
+    uint8_t mac_address[6];
+    bool reserved; // never assigned to any client (e.g. the host's address)
+  };
+
+  uint8_t mac_address[6];
+  uint8_t ip_address[4];
+  std::vector<in6_addr> ipv6_addresses;
+  bool respond_arp;
+  bool respond_ndp;
+  uint32_t dhcp_pool_start; // host byte order
+  uint32_t dhcp_subnet_mask; // host byte order
+  uint32_t dhcp_lease_seconds;
+  std::vector<Lease> leases;
+
+  bool handle_arp(const void* data, size_t size, std::string& response);
+  bool handle_ndp(const void* data, size_t size, std::string& response);
+  bool handle_dhcp(const void* data, size_t size, std::string& response);
+
+  ssize_t find_lease(const uint8_t* mac_address, uint32_t requested_address,
+      uint32_t now) const;
+};
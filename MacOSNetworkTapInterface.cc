@@ -7,7 +7,10 @@ struct prf_ra {
   u_char reserved : 6;
 } prf_ra;
 
+#include <ifaddrs.h>
+#include <limits.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <net/bpf.h>
@@ -16,11 +19,16 @@ struct prf_ra {
 #include <net/ndrv.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <netinet/tcp.h>
 #include <netinet6/in6_var.h>
 #include <netinet6/nd6.h>
 
 #include <phosg/Network.hh>
 #include <phosg/Process.hh>
+#include <algorithm>
+#include <vector>
+
+#include "Checksum.hh"
 
 using namespace std;
 
@@ -101,6 +109,419 @@ ssize_t MacOSNetworkTapInterface::get_frame_size(const void* data, size_t size)
 
 
 
+struct tcp_frame_info {
+  uint8_t* ip_header;
+  size_t ip_header_size;
+  size_t ip_size; // includes IP header, TCP header, and payload
+  bool is_ipv6;
+  tcphdr* tcp;
+  size_t tcp_header_size;
+};
+
+// Finds the IP and TCP headers in an Ethernet frame. Returns false if the frame
+// isn't an unfragmented TCP segment directly over IPv4 or IPv6, or is
+// truncated.
+static bool parse_tcp_frame(void* data, size_t size, tcp_frame_info* info) {
+  if (size < sizeof(ether_header)) {
+    return false;
+  }
+  const ether_header* eth = reinterpret_cast<const ether_header*>(data);
+  info->ip_header = reinterpret_cast<uint8_t*>(data) + sizeof(ether_header);
+  size_t available_size = size - sizeof(ether_header);
+
+  switch (ntohs(eth->ether_type)) {
+    case 0x0800: { // IPv4
+      if (available_size < sizeof(ip)) {
+        return false;
+      }
+      const ip* ip4 = reinterpret_cast<const ip*>(info->ip_header);
+      if ((ip4->ip_p != IPPROTO_TCP) || (ntohs(ip4->ip_off) & (IP_MF | IP_OFFMASK))) {
+        return false;
+      }
+      info->ip_header_size = ip4->ip_hl * 4;
+      info->ip_size = ntohs(ip4->ip_len);
+      info->is_ipv6 = false;
+      break;
+    }
+
+    case 0x86DD: { // IPv6
+      if (available_size < sizeof(ip6_hdr)) {
+        return false;
+      }
+      const ip6_hdr* ip6 = reinterpret_cast<const ip6_hdr*>(info->ip_header);
+      if (ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_TCP) {
+        return false;
+      }
+      info->ip_header_size = sizeof(ip6_hdr);
+      info->ip_size = sizeof(ip6_hdr) + ntohs(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+      info->is_ipv6 = true;
+      break;
+    }
+
+    default:
+      return false;
+  }
+
+  if ((info->ip_size > available_size) ||
+      (info->ip_header_size + sizeof(tcphdr) > info->ip_size)) {
+    return false;
+  }
+  info->tcp = reinterpret_cast<tcphdr*>(info->ip_header + info->ip_header_size);
+  info->tcp_header_size = info->tcp->th_off * 4;
+  return (info->tcp_header_size >= sizeof(tcphdr)) &&
+      (info->ip_header_size + info->tcp_header_size <= info->ip_size);
+}
+
+static void update_checksums(const tcp_frame_info& info) {
+  size_t tcp_size = info.ip_size - info.ip_header_size;
+  uint32_t sum = 0;
+  if (info.is_ipv6) {
+    const ip6_hdr* ip6 = reinterpret_cast<const ip6_hdr*>(info.ip_header);
+    uint8_t pseudo_header_tail[8] = {
+        static_cast<uint8_t>(tcp_size >> 24), static_cast<uint8_t>(tcp_size >> 16),
+        static_cast<uint8_t>(tcp_size >> 8), static_cast<uint8_t>(tcp_size),
+        0, 0, 0, IPPROTO_TCP};
+    sum = checksum_add(sum, &ip6->ip6_src, sizeof(ip6->ip6_src));
+    sum = checksum_add(sum, &ip6->ip6_dst, sizeof(ip6->ip6_dst));
+    sum = checksum_add(sum, pseudo_header_tail, sizeof(pseudo_header_tail));
+
+  } else {
+    ip* ip4 = reinterpret_cast<ip*>(info.ip_header);
+    ip4->ip_sum = 0;
+    ip4->ip_sum = checksum_finish(checksum_add(0, ip4, info.ip_header_size));
+
+    uint8_t pseudo_header_tail[4] = {0, IPPROTO_TCP,
+        static_cast<uint8_t>(tcp_size >> 8), static_cast<uint8_t>(tcp_size)};
+    sum = checksum_add(sum, &ip4->ip_src, sizeof(ip4->ip_src));
+    sum = checksum_add(sum, &ip4->ip_dst, sizeof(ip4->ip_dst));
+    sum = checksum_add(sum, pseudo_header_tail, sizeof(pseudo_header_tail));
+  }
+
+  info.tcp->th_sum = 0;
+  info.tcp->th_sum = checksum_finish(checksum_add(sum, info.tcp, tcp_size));
+}
+
+static vector<string> segment_tcp_frame(
+    const void* data, const tcp_frame_info& info, size_t mtu) {
+  size_t headers_size = sizeof(ether_header) + info.ip_header_size + info.tcp_header_size;
+  size_t payload_size = info.ip_size - info.ip_header_size - info.tcp_header_size;
+  size_t max_segment_size = mtu - info.ip_header_size - info.tcp_header_size;
+  const char* payload = reinterpret_cast<const char*>(data) + headers_size;
+  uint32_t seq = ntohl(info.tcp->th_seq);
+  uint16_t ip_id = info.is_ipv6 ? 0 : ntohs(reinterpret_cast<const ip*>(info.ip_header)->ip_id);
+  uint8_t flags = info.tcp->th_flags;
+
+  vector<string> ret;
+  for (size_t offset = 0; offset < payload_size; offset += max_segment_size) {
+    size_t segment_size = min(max_segment_size, payload_size - offset);
+    string& segment = ret.emplace_back(reinterpret_cast<const char*>(data), headers_size);
+    segment.append(payload + offset, segment_size);
+
+    tcp_frame_info segment_info = info;
+    segment_info.ip_header = reinterpret_cast<uint8_t*>(segment.data()) + sizeof(ether_header);
+    segment_info.tcp = reinterpret_cast<tcphdr*>(segment_info.ip_header + info.ip_header_size);
+    segment_info.ip_size = info.ip_header_size + info.tcp_header_size + segment_size;
+    if (info.is_ipv6) {
+      ip6_hdr* ip6 = reinterpret_cast<ip6_hdr*>(segment_info.ip_header);
+      ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(segment_info.ip_size - sizeof(ip6_hdr));
+    } else {
+      ip* ip4 = reinterpret_cast<ip*>(segment_info.ip_header);
+      ip4->ip_len = htons(segment_info.ip_size);
+      ip4->ip_id = htons(ip_id + ret.size() - 1);
+    }
+
+    // Like TSO hardware, only the first segment keeps CWR and only the last
+    // keeps FIN and PSH
+    segment_info.tcp->th_seq = htonl(seq + offset);
+    segment_info.tcp->th_flags = flags;
+    if (offset != 0) {
+      segment_info.tcp->th_flags &= ~TH_CWR;
+    }
+    if (offset + segment_size < payload_size) {
+      segment_info.tcp->th_flags &= ~(TH_FIN | TH_PUSH);
+    }
+    update_checksums(segment_info);
+  }
+  return ret;
+}
+
+// Splits an IPv4 packet into fragments that fit in mtu. The packet may itself
+// be a fragment; the offsets and MF flag are adjusted accordingly. All options
+// are copied into every fragment.
+static vector<string> fragment_ipv4_frame(
+    const void* data, size_t ip_header_size, size_t ip_size, size_t mtu) {
+  const char* frame = reinterpret_cast<const char*>(data);
+  size_t headers_size = sizeof(ether_header) + ip_header_size;
+  uint16_t orig_ip_off = ntohs(reinterpret_cast<const ip*>(frame + sizeof(ether_header))->ip_off);
+  size_t base_offset = (orig_ip_off & IP_OFFMASK) * 8;
+  size_t payload_size = ip_size - ip_header_size;
+  size_t max_fragment_size = (mtu - ip_header_size) & ~7;
+
+  vector<string> ret;
+  for (size_t offset = 0; offset < payload_size; offset += max_fragment_size) {
+    size_t fragment_size = min(max_fragment_size, payload_size - offset);
+    bool more_fragments = (orig_ip_off & IP_MF) || (offset + fragment_size < payload_size);
+    string& fragment = ret.emplace_back(frame, headers_size);
+    fragment.append(frame + headers_size + offset, fragment_size);
+
+    ip* ip4 = reinterpret_cast<ip*>(fragment.data() + sizeof(ether_header));
+    ip4->ip_len = htons(ip_header_size + fragment_size);
+    ip4->ip_off = htons(((base_offset + offset) / 8) | (more_fragments ? IP_MF : 0));
+    ip4->ip_sum = 0;
+    ip4->ip_sum = checksum_finish(checksum_add(0, ip4, ip_header_size));
+  }
+  return ret;
+}
+
+// Builds an ICMP "fragmentation needed" message telling the sender of an IPv4
+// packet that it must fit in mtu. The message appears to come from the
+// packet's destination. Returns an empty string if no message should be sent
+// (RFC 1122 forbids errors about non-initial fragments, multicast or broadcast
+// packets, and ICMP errors).
+static string make_icmp_fragmentation_needed(
+    const void* data, size_t ip_header_size, size_t ip_size, size_t mtu) {
+  const ether_header* eth = reinterpret_cast<const ether_header*>(data);
+  const ip* orig_ip4 = reinterpret_cast<const ip*>(eth + 1);
+  const uint8_t* orig_ip_data = reinterpret_cast<const uint8_t*>(orig_ip4);
+  if ((ntohs(orig_ip4->ip_off) & IP_OFFMASK) || (orig_ip_data[16] >= 224)) {
+    return "";
+  }
+  if ((orig_ip4->ip_p == IPPROTO_ICMP) && (ip_size > ip_header_size)) {
+    uint8_t type = orig_ip_data[ip_header_size];
+    if ((type == 3) || (type == 4) || (type == 5) || (type == 11) || (type == 12)) {
+      return "";
+    }
+  }
+
+  // The original IP header and 8 bytes of its payload are returned
+  size_t quoted_size = min(ip_size, ip_header_size + 8);
+  size_t icmp_size = 8 + quoted_size;
+  string ret(sizeof(ether_header) + sizeof(ip) + icmp_size, '\0');
+  ether_header* ret_eth = reinterpret_cast<ether_header*>(ret.data());
+  memcpy(ret_eth->ether_dhost, eth->ether_shost, 6);
+  memcpy(ret_eth->ether_shost, eth->ether_dhost, 6);
+  ret_eth->ether_type = htons(0x0800);
+
+  ip* ret_ip4 = reinterpret_cast<ip*>(ret_eth + 1);
+  ret_ip4->ip_v = 4;
+  ret_ip4->ip_hl = sizeof(ip) / 4;
+  ret_ip4->ip_len = htons(sizeof(ip) + icmp_size);
+  ret_ip4->ip_ttl = 64;
+  ret_ip4->ip_p = IPPROTO_ICMP;
+  ret_ip4->ip_src = orig_ip4->ip_dst;
+  ret_ip4->ip_dst = orig_ip4->ip_src;
+  ret_ip4->ip_sum = checksum_finish(checksum_add(0, ret_ip4, sizeof(ip)));
+
+  uint8_t* icmp = reinterpret_cast<uint8_t*>(ret_ip4 + 1);
+  icmp[0] = 3; // destination unreachable
+  icmp[1] = 4; // fragmentation needed and DF set
+  icmp[6] = mtu >> 8;
+  icmp[7] = mtu & 0xFF;
+  memcpy(&icmp[8], orig_ip4, quoted_size);
+  uint16_t checksum = checksum_finish(checksum_add(0, icmp, icmp_size));
+  memcpy(&icmp[2], &checksum, sizeof(checksum));
+  return ret;
+}
+
+// Builds an ICMPv6 "packet too big" message telling the sender of an IPv6
+// packet that it must fit in mtu. Like the IPv4 version, this appears to come
+// from the packet's destination, and returns an empty string if no message
+// should be sent (for multicast packets and ICMPv6 errors).
+static string make_icmp6_packet_too_big(const void* data, size_t ip_size, size_t mtu) {
+  const ether_header* eth = reinterpret_cast<const ether_header*>(data);
+  const ip6_hdr* orig_ip6 = reinterpret_cast<const ip6_hdr*>(eth + 1);
+  const uint8_t* orig_ip_data = reinterpret_cast<const uint8_t*>(orig_ip6);
+  if ((orig_ip_data[24] == 0xFF) || (mtu < 1280)) {
+    return "";
+  }
+  if ((orig_ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_ICMPV6) &&
+      (ip_size > sizeof(ip6_hdr)) && (orig_ip_data[sizeof(ip6_hdr)] < 128)) {
+    return "";
+  }
+
+  // As much of the original packet as fits in the minimum IPv6 MTU is returned
+  size_t quoted_size = min<size_t>(ip_size, 1280 - sizeof(ip6_hdr) - 8);
+  size_t icmp_size = 8 + quoted_size;
+  string ret(sizeof(ether_header) + sizeof(ip6_hdr) + icmp_size, '\0');
+  ether_header* ret_eth = reinterpret_cast<ether_header*>(ret.data());
+  memcpy(ret_eth->ether_dhost, eth->ether_shost, 6);
+  memcpy(ret_eth->ether_shost, eth->ether_dhost, 6);
+  ret_eth->ether_type = htons(0x86DD);
+
+  ip6_hdr* ret_ip6 = reinterpret_cast<ip6_hdr*>(ret_eth + 1);
+  ret_ip6->ip6_ctlun.ip6_un1.ip6_un1_flow = htonl(0x60000000);
+  ret_ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(icmp_size);
+  ret_ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_ICMPV6;
+  ret_ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = 64;
+  ret_ip6->ip6_src = orig_ip6->ip6_dst;
+  ret_ip6->ip6_dst = orig_ip6->ip6_src;
+
+  uint8_t* icmp = reinterpret_cast<uint8_t*>(ret_ip6 + 1);
+  icmp[0] = 2; // packet too big
+  icmp[4] = mtu >> 24;
+  icmp[5] = mtu >> 16;
+  icmp[6] = mtu >> 8;
+  icmp[7] = mtu & 0xFF;
+  memcpy(&icmp[8], orig_ip6, quoted_size);
+
+  uint8_t pseudo_header_tail[8] = {0, 0,
+      static_cast<uint8_t>(icmp_size >> 8), static_cast<uint8_t>(icmp_size),
+      0, 0, 0, IPPROTO_ICMPV6};
+  uint32_t sum = checksum_add(0, &ret_ip6->ip6_src, sizeof(ret_ip6->ip6_src));
+  sum = checksum_add(sum, &ret_ip6->ip6_dst, sizeof(ret_ip6->ip6_dst));
+  sum = checksum_add(sum, pseudo_header_tail, sizeof(pseudo_header_tail));
+  uint16_t checksum = checksum_finish(checksum_add(sum, icmp, icmp_size));
+  memcpy(&icmp[2], &checksum, sizeof(checksum));
+  return ret;
+}
+
+vector<string> MacOSNetworkTapInterface::segment_frame(
+    const void* data, size_t size, size_t mtu, string* icmp_response) {
+  if (icmp_response) {
+    icmp_response->clear();
+  }
+  if (size <= mtu + sizeof(ether_header)) {
+    return {string(reinterpret_cast<const char*>(data), size)};
+  }
+
+  // parse_tcp_frame needs a non-const pointer, but we don't modify the input
+  tcp_frame_info info;
+  if (parse_tcp_frame(const_cast<void*>(data), size, &info) &&
+      (info.ip_header_size + info.tcp_header_size < mtu)) {
+    if (info.ip_size <= mtu) { // it's just padded
+      return {string(reinterpret_cast<const char*>(data), size)};
+    }
+    return segment_tcp_frame(data, info, mtu);
+  }
+
+  const ether_header* eth = reinterpret_cast<const ether_header*>(data);
+  size_t available_size = size - sizeof(ether_header);
+  switch (ntohs(eth->ether_type)) {
+    case 0x0800: { // IPv4
+      if (available_size < sizeof(ip)) {
+        break;
+      }
+      const ip* ip4 = reinterpret_cast<const ip*>(eth + 1);
+      size_t ip_header_size = ip4->ip_hl * 4;
+      size_t ip_size = ntohs(ip4->ip_len);
+      if ((ip_header_size < sizeof(ip)) || (ip_header_size > ip_size) ||
+          (ip_size > available_size)) {
+        break;
+      }
+      if (ip_size <= mtu) {
+        return {string(reinterpret_cast<const char*>(data), size)};
+      }
+      if (!(ntohs(ip4->ip_off) & IP_DF) && (ip_header_size + 8 <= mtu)) {
+        return fragment_ipv4_frame(data, ip_header_size, ip_size, mtu);
+      }
+      if (icmp_response) {
+        *icmp_response = make_icmp_fragmentation_needed(data, ip_header_size, ip_size, mtu);
+      }
+      break;
+    }
+
+    case 0x86DD: { // IPv6
+      if (available_size < sizeof(ip6_hdr)) {
+        break;
+      }
+      const ip6_hdr* ip6 = reinterpret_cast<const ip6_hdr*>(eth + 1);
+      size_t ip_size = sizeof(ip6_hdr) + ntohs(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+      if (ip_size > available_size) {
+        break;
+      }
+      if (ip_size <= mtu) {
+        return {string(reinterpret_cast<const char*>(data), size)};
+      }
+      // Only the sender may fragment IPv6 packets, so tell it to
+      if (icmp_response) {
+        *icmp_response = make_icmp6_packet_too_big(data, ip_size, mtu);
+      }
+      break;
+    }
+  }
+
+  return {};
+}
+
+vector<string> MacOSNetworkTapInterface::split_frame_for_client(
+    const void* data, size_t size, size_t client_mtu) {
+  string icmp_response;
+  auto ret = this->segment_frame(data, size, client_mtu, &icmp_response);
+  if (ret.empty()) {
+    this->dropped_frame_count++;
+    if (!icmp_response.empty()) {
+      this->send(icmp_response);
+    } else {
+      fprintf(stderr,
+          "warning: dropped frame too large for client (0x%zX bytes; %zu dropped so far)\n",
+          size, this->dropped_frame_count);
+    }
+  }
+  return ret;
+}
+
+size_t MacOSNetworkTapInterface::get_dropped_frame_count() const {
+  return this->dropped_frame_count;
+}
+
+bool MacOSNetworkTapInterface::raise_tcp_mss(void* data, size_t size, size_t mtu,
+    const uint8_t* ipv4_address, const vector<in6_addr>& ipv6_addresses) {
+  tcp_frame_info info;
+  if (!parse_tcp_frame(data, size, &info) || !(info.tcp->th_flags & TH_SYN) ||
+      (mtu <= info.ip_header_size + sizeof(tcphdr))) {
+    return false;
+  }
+
+  // Only connections to the host itself benefit from this; other peers (if the
+  // host routes the client's traffic elsewhere) must see the client's real MSS
+  if (info.is_ipv6) {
+    const ip6_hdr* ip6 = reinterpret_cast<const ip6_hdr*>(info.ip_header);
+    if (none_of(ipv6_addresses.begin(), ipv6_addresses.end(), [&](const in6_addr& addr) {
+      return !memcmp(&addr, &ip6->ip6_dst, sizeof(addr));
+    })) {
+      return false;
+    }
+  } else {
+    const ip* ip4 = reinterpret_cast<const ip*>(info.ip_header);
+    if (memcmp(&ip4->ip_dst, ipv4_address, 4)) {
+      return false;
+    }
+  }
+  size_t new_mss = min<size_t>(mtu - info.ip_header_size - sizeof(tcphdr), 0xFFFF);
+
+  uint8_t* options = reinterpret_cast<uint8_t*>(info.tcp) + sizeof(tcphdr);
+  size_t options_size = info.tcp_header_size - sizeof(tcphdr);
+  for (size_t offset = 0; offset < options_size;) {
+    uint8_t kind = options[offset];
+    if (kind == TCPOPT_EOL) {
+      break;
+    } else if (kind == TCPOPT_NOP) {
+      offset++;
+      continue;
+    }
+    if (offset + 2 > options_size) {
+      break;
+    }
+    uint8_t length = options[offset + 1];
+    if ((length < 2) || (offset + length > options_size)) {
+      break;
+    }
+    if ((kind == TCPOPT_MAXSEG) && (length == TCPOLEN_MAXSEG)) {
+      size_t mss = (options[offset + 2] << 8) | options[offset + 3];
+      if (mss >= new_mss) {
+        return false;
+      }
+      options[offset + 2] = new_mss >> 8;
+      options[offset + 3] = new_mss & 0xFF;
+      update_checksums(info);
+      return true;
+    }
+    offset += length;
+  }
+  return false;
+}
+
+
 MacOSNetworkTapInterface::MacOSNetworkTapInterface(
     uint8_t mac_address[6],
     uint8_t ip_address[4],
@@ -110,17 +531,23 @@ MacOSNetworkTapInterface::MacOSNetworkTapInterface(
     size_t metric,
     bool enable_nud,
     bool enable_router_advertisements,
-    const char* ifconfig_command)
+    const char* ifconfig_command,
+    const uint8_t* netmask)
   : network_device_number(network_device_number),
     io_device_number(io_device_number),
     mtu(mtu),
     metric(metric),
     enable_nud(enable_nud),
     enable_router_advertisements(enable_router_advertisements),
-    ifconfig_command(ifconfig_command) {
+    ifconfig_command(ifconfig_command),
+    dropped_frame_count(0) {
 
   memcpy(this->mac_address, mac_address, 6);
   memcpy(this->ip_address, ip_address, 4);
+  if (netmask) {
+    this->netmask = string_printf("%hhu.%hhu.%hhu.%hhu",
+        netmask[0], netmask[1], netmask[2], netmask[3]);
+  }
 }
 
 void MacOSNetworkTapInterface::open() {
@@ -146,7 +573,12 @@ void MacOSNetworkTapInterface::open() {
     run_process({this->ifconfig_command, this->network_device_name, "lladdr", mac});
     string ip = string_printf("%02hhu.%02hhu.%02hhu.%02hhu",
         this->ip_address[0], this->ip_address[1], this->ip_address[2], this->ip_address[3]);
-    run_process({this->ifconfig_command, this->network_device_name, ip});
+    if (this->netmask.empty()) {
+      run_process({this->ifconfig_command, this->network_device_name, ip});
+    } else {
+      run_process({this->ifconfig_command, this->network_device_name, ip,
+          "netmask", this->netmask});
+    }
   }
 
   run_process({this->ifconfig_command, this->io_device_name, "peer", this->network_device_name});
@@ -236,6 +668,7 @@ void MacOSNetworkTapInterface::open() {
           errno));
     }
     this->max_read_size = flags;
+    this->receive_buffer.resize(this->max_read_size);
 
     flags = 1;
     if (ioctl(this->bpf_fd, BIOCIMMEDIATE, &flags) != 0) {
@@ -308,9 +741,122 @@ int MacOSNetworkTapInterface::get_fd() {
   return this->bpf_fd;
 }
 
+vector<in6_addr> MacOSNetworkTapInterface::get_ipv6_addresses() const {
+  struct ifaddrs* ifas;
+  if (getifaddrs(&ifas) != 0) {
+    throw runtime_error(string_printf("cannot list interface addresses (%d)", errno));
+  }
+
+  vector<in6_addr> ret;
+  scoped_fd s(socket(AF_INET6, SOCK_DGRAM, 0));
+  for (struct ifaddrs* ifa = ifas; ifa; ifa = ifa->ifa_next) {
+    if (!ifa->ifa_addr || (ifa->ifa_addr->sa_family != AF_INET6) ||
+        (this->network_device_name != ifa->ifa_name)) {
+      continue;
+    }
+    const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(ifa->ifa_addr);
+
+    // Skip addresses that are still being checked for duplicates, or that
+    // failed the check
+    if (s.is_open()) {
+      struct in6_ifreq ifr;
+      memset(&ifr, 0, sizeof(ifr));
+      strncpy(ifr.ifr_name, this->network_device_name.c_str(), sizeof(ifr.ifr_name));
+      ifr.ifr_ifru.ifru_addr = *sin6;
+      if ((ioctl(s, SIOCGIFAFLAG_IN6, &ifr) == 0) &&
+          (ifr.ifr_ifru.ifru_flags6 & (IN6_IFF_TENTATIVE | IN6_IFF_DUPLICATED | IN6_IFF_DETACHED))) {
+        continue;
+      }
+    }
+
+    // The kernel embeds the interface index in link-local addresses; it isn't
+    // part of the address that appears on the wire
+    in6_addr addr = sin6->sin6_addr;
+    if (IN6_IS_ADDR_LINKLOCAL(&addr)) {
+      addr.s6_addr[2] = 0;
+      addr.s6_addr[3] = 0;
+    }
+    ret.emplace_back(addr);
+  }
+  freeifaddrs(ifas);
+  return ret;
+}
+
 void MacOSNetworkTapInterface::on_data_available() {
-  string receive_buffer(this->max_read_size, '\0');
-  ssize_t size = read(this->bpf_fd, const_cast<char*>(receive_buffer.data()),
+  this->read_frames([&](const char* data, size_t size) {
+    this->received_frames.emplace_back(data, size);
+  });
+}
+
+// Like writex(), but for an array of buffers. iovs is modified in place if the
+// kernel accepts only part of the data in any call.
+static void writevx(int fd, vector<iovec>& iovs) {
+  size_t start_index = 0;
+  while (start_index < iovs.size()) {
+    size_t count = min<size_t>(iovs.size() - start_index, IOV_MAX);
+    ssize_t bytes_written = writev(fd, &iovs[start_index], count);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw runtime_error(string_printf("write error to client (%d)", errno));
+    }
+    while ((start_index < iovs.size()) &&
+           (static_cast<size_t>(bytes_written) >= iovs[start_index].iov_len)) {
+      bytes_written -= iovs[start_index].iov_len;
+      start_index++;
+    }
+    if (bytes_written > 0) {
+      iovs[start_index].iov_base = reinterpret_cast<char*>(iovs[start_index].iov_base) + bytes_written;
+      iovs[start_index].iov_len -= bytes_written;
+    }
+  }
+}
+
+size_t MacOSNetworkTapInterface::forward_to_fd(
+    int fd, bool use_framed_protocol, size_t client_mtu) {
+  // Collect pointers to all the frames first, then write them all at once. The
+  // size fields need stable addresses, so they go in a vector that's reserved
+  // before any pointers into it are taken. Any frames already queued by
+  // on_data_available() are sent first so ordering is preserved. Segmented
+  // frames go in a deque since its elements don't move when it grows.
+  vector<pair<const char*, size_t>> frames;
+  deque<string> segments;
+  auto add_frame = [&](const char* data, size_t size) {
+    if (!client_mtu || (size <= client_mtu + sizeof(ether_header))) {
+      frames.emplace_back(data, size);
+    } else {
+      for (auto& segment : this->split_frame_for_client(data, size, client_mtu)) {
+        const string& s = segments.emplace_back(std::move(segment));
+        frames.emplace_back(s.data(), s.size());
+      }
+    }
+  };
+  for (const auto& frame : this->received_frames) {
+    add_frame(frame.data(), frame.size());
+  }
+  this->read_frames(add_frame);
+
+  vector<uint16_t> sizes;
+  vector<iovec> iovs;
+  sizes.reserve(frames.size());
+  iovs.reserve(frames.size() * (use_framed_protocol ? 2 : 1));
+  for (const auto& frame : frames) {
+    if (use_framed_protocol) {
+      sizes.emplace_back(frame.second);
+      iovs.emplace_back(iovec{&sizes.back(), sizeof(uint16_t)});
+    }
+    iovs.emplace_back(iovec{const_cast<char*>(frame.first), frame.second});
+  }
+  writevx(fd, iovs);
+
+  this->received_frames.clear();
+  return frames.size();
+}
+
+void MacOSNetworkTapInterface::read_frames(
+    function<void(const char*, size_t)> fn) {
+  ssize_t size = read(this->bpf_fd, const_cast<char*>(this->receive_buffer.data()),
       this->max_read_size);
   if (size < 0) {
     throw runtime_error(string_printf("read error from network interface (%d)", errno));
@@ -319,13 +865,12 @@ void MacOSNetworkTapInterface::on_data_available() {
   } else {
     for (ssize_t offset = 0; offset < size;) {
       const bpf_hdr* header = reinterpret_cast<const bpf_hdr*>(
-          receive_buffer.data() + offset);
+          this->receive_buffer.data() + offset);
 
       if ((header->bh_caplen > 0) &&
           (offset + header->bh_hdrlen + header->bh_caplen <= size)) {
-        const char* data = receive_buffer.data() + offset + header->bh_hdrlen;
-        uint16_t frame_size = header->bh_caplen;
-        this->received_frames.emplace_back(data, frame_size);
+        fn(this->receive_buffer.data() + offset + header->bh_hdrlen,
+            header->bh_caplen);
       }
       offset += BPF_WORDALIGN(header->bh_hdrlen + header->bh_caplen);
     }
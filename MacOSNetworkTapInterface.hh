@@ -1,8 +1,11 @@
+#include <netinet/in.h>
 #include <stdint.h>
 
 #include <deque>
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 #include <phosg/Process.hh>
 #include <phosg/Filesystem.hh>
 
@@ -17,7 +20,8 @@ public:
       size_t metric = 0,
       bool enable_nud = true,
       bool enable_router_advertisements = false,
-      const char* ifconfig_command = "ifconfig");
+      const char* ifconfig_command = "ifconfig",
+      const uint8_t* netmask = nullptr); // nullptr = ifconfig's default
   virtual ~MacOSNetworkTapInterface();
 
   void open();
@@ -37,11 +41,59 @@ public:
   int get_fd();
   void on_data_available();
 
+  // Returns the usable IPv6 addresses of the host-side interface. Addresses
+  // that are tentative (still undergoing duplicate address detection) are
+  // omitted, so this should be called again later if the result is needed to
+  // be complete.
+  std::vector<in6_addr> get_ipv6_addresses() const;
+
+  // Reads all available frames from the interface and writes them to fd
+  // directly out of the receive buffer, using as few writev() calls as
+  // possible. This avoids copying each frame into its own string, so it's
+  // faster than calling on_data_available() followed by recv() in a loop. If
+  // use_framed_protocol is true, each frame is preceded by its 16-bit size in
+  // native byte order. If client_mtu is nonzero, frames that are too large for
+  // it are split with split_frame_for_client() first. Returns the number of
+  // frames written.
+  size_t forward_to_fd(int fd, bool use_framed_protocol, size_t client_mtu = 0);
+
+  // Splits a frame from the host with segment_frame(). If the frame can't be
+  // split, it's dropped; the ICMP error from segment_frame() (if any) is sent
+  // back to the host, and a warning is printed if there was none.
+  std::vector<std::string> split_frame_for_client(
+      const void* data, size_t size, size_t client_mtu);
+  // Returns the number of frames split_frame_for_client() has dropped,
+  // including those dropped in forward_to_fd().
+  size_t get_dropped_frame_count() const;
+
   // Computes the size of the frame based on the contents and protocol.
   // Returns 0 if the header is incomplete; returns -1 if the protocol is
   // unsupported or the frame is corrupt.
   static ssize_t get_frame_size(const void* data, size_t size);
 
+  // Splits a frame into multiple frames, none of which contains an IP packet
+  // larger than mtu bytes. TCP segments over IPv4 or IPv6 are split the way
+  // TSO hardware would do it: sequence numbers, lengths, and checksums are
+  // updated in each output frame. Other IPv4 packets are fragmented unless
+  // they have DF set. Frames that are already small enough are returned
+  // unchanged. Anything else can't be split, so an empty vector is returned;
+  // in this case, if icmp_response is given, it's set to an ICMP "fragmentation
+  // needed" or ICMPv6 "packet too big" frame that should be sent back to the
+  // sender (or to an empty string if no error should be sent).
+  static std::vector<std::string> segment_frame(
+      const void* data, size_t size, size_t mtu,
+      std::string* icmp_response = nullptr);
+
+  // If the frame is a TCP SYN to one of the given host addresses, and its MSS
+  // option is smaller than what mtu would allow, raises the MSS and updates the
+  // checksum. This makes the host send segments as large as its own MTU
+  // allows, which segment_frame() can then split for the client. SYNs to any
+  // other address are left alone, since the host may be routing them to peers
+  // that can't send such large segments. Returns true if the frame was
+  // modified.
+  static bool raise_tcp_mss(void* data, size_t size, size_t mtu,
+      const uint8_t* ipv4_address, const std::vector<in6_addr>& ipv6_addresses);
+
 protected:
   // arguments
   ssize_t network_device_number;
@@ -53,6 +105,7 @@ protected:
   bool enable_nud;
   bool enable_router_advertisements;
   std::string ifconfig_command;
+  std::string netmask;
 
   // internal state
   scoped_fd bpf_fd;
@@ -61,5 +114,9 @@ protected:
   std::string network_device_name;
   std::string io_device_name;
   std::deque<std::string> received_frames;
+  std::string receive_buffer;
   size_t max_read_size;
+  size_t dropped_frame_count;
+
+  void read_frames(std::function<void(const char*, size_t)> fn);
 };
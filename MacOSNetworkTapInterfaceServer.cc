@@ -1,11 +1,14 @@
 #include <stdint.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include <string>
+#include <vector>
 #include <phosg/Filesystem.hh>
 #include <phosg/Network.hh>
 #include <phosg/Process.hh>
 
+#include "LocalResponder.hh"
 #include "MacOSNetworkTapInterface.hh"
 
 using namespace std;
@@ -46,6 +49,10 @@ Options:\n\
     172.30.0.1)\n\
   --mtu=N\n\
     Set the MTU (maximum transmission unit) to this many bytes. (Default 1500)\n\
+  --client-mtu=N\n\
+    Split frames from the host so no IP packet sent to the client is larger\n\
+    than this many bytes (at least 68), and raise the MSS of the client\'s TCP\n\
+    connections to the host to match --mtu. See README.md for details.\n\
   --metric=N\n\
     Set the interface metric to this value. (Default 0)\n\
   --disable-nud\n\
@@ -60,8 +67,30 @@ Options:\n\
     Listen for a client connection on this TCP port on a specific interface.\n\
   --listen=PATH\n\
     Listen for a client connection on this Unix socket.\n\
+  --respond-arp\n\
+    Answer ARP requests for the host\'s IPv4 address (--ip-address) directly,\n\
+    without sending them to the host.\n\
+  --respond-ndp\n\
+    Answer IPv6 neighbor solicitations for the host\'s IPv6 addresses\n\
+    directly, without sending them to the host. The addresses are read from\n\
+    the host-side interface (and re-read periodically), so solicitations for\n\
+    addresses that are still tentative go to the host as usual.\n\
+  --dhcp-pool-start=XXX.XXX.XXX.XXX\n\
+  --dhcp-pool-size=N\n\
+    Answer DHCP requests from the client directly, assigning addresses from\n\
+    this range. The host\'s IPv4 address is given to the client as its router\n\
+    and DNS server. Both options must be given to enable DHCP. The pool must\n\
+    be inside the subnet given by --ip-address and --dhcp-subnet-mask, and\n\
+    must not include the subnet\'s network or broadcast address.\n\
+  --dhcp-subnet-mask=XXX.XXX.XXX.XXX\n\
+    Give this subnet mask to DHCP clients, and use it for the host-side\n\
+    interface when DHCP is enabled. (Default 255.255.255.0)\n\
+  --dhcp-lease-time=N\n\
+    Give DHCP leases that last this many seconds. (Default 86400)\n\
   --show-data\n\
     Print a hex/ASCII dump of all frames sent and received over the interface.\n\
+    This disables direct forwarding of frames from the interface to the\n\
+    client, so it reduces throughput.\n\
   --show-size-warnings\n\
     Print a hex/ASCII dump of all frames sent by the client for which tapserver\n\
     would compute the wrong frame size. This may be useful when testing with a\n\
@@ -81,10 +110,20 @@ int main(int argc, char** argv) {
   uint8_t mac_address[6] = {0x90, 0x90, 0x90, 0x90, 0x90, 0x90};
   uint8_t ip_address[4] = {172, 30, 0, 1};
   size_t mtu = 1500;
+  size_t client_mtu = 0;
   size_t metric = 0;
   bool enable_nud = true;
   bool enable_router_advertisements = false;
   const char* ifconfig_command = "ifconfig";
+  // local responder options
+  bool respond_arp = false;
+  bool respond_ndp = false;
+  uint8_t dhcp_pool_start[4] = {0, 0, 0, 0};
+  bool dhcp_pool_start_given = false;
+  ssize_t dhcp_pool_size = 0;
+  bool dhcp_pool_size_given = false;
+  uint8_t dhcp_subnet_mask[4] = {255, 255, 255, 0};
+  uint32_t dhcp_lease_seconds = 86400;
   // other options
   scoped_fd listen_fd;
   bool show_data = false;
@@ -113,6 +152,13 @@ int main(int argc, char** argv) {
         }
       } else if (!strncmp(argv[x], "--mtu=", 6)) {
         mtu = atoi(&argv[x][6]);
+      } else if (!strncmp(argv[x], "--client-mtu=", 13)) {
+        char* end;
+        long value = strtol(&argv[x][13], &end, 10);
+        if ((end == &argv[x][13]) || *end || (value < 68)) {
+          throw invalid_argument("--client-mtu must be a number no less than 68");
+        }
+        client_mtu = value;
       } else if (!strncmp(argv[x], "--metric=", 9)) {
         metric = atoi(&argv[x][9]);
       } else if (!strcmp(argv[x], "--disable-nud")) {
@@ -144,6 +190,30 @@ int main(int argc, char** argv) {
         } else {
           throw invalid_argument("--listen must be an addr:port, port, or unix socket path");
         }
+      } else if (!strcmp(argv[x], "--respond-arp")) {
+        respond_arp = true;
+      } else if (!strcmp(argv[x], "--respond-ndp")) {
+        respond_ndp = true;
+      } else if (!strncmp(argv[x], "--dhcp-pool-start=", 18)) {
+        if (sscanf(&argv[x][18], "%hhu.%hhu.%hhu.%hhu", &dhcp_pool_start[0],
+            &dhcp_pool_start[1], &dhcp_pool_start[2], &dhcp_pool_start[3]) != 4) {
+          throw invalid_argument("--dhcp-pool-start must be 4 decimal bytes");
+        }
+        dhcp_pool_start_given = true;
+      } else if (!strncmp(argv[x], "--dhcp-pool-size=", 17)) {
+        dhcp_pool_size = strtol(&argv[x][17], nullptr, 10);
+        dhcp_pool_size_given = true;
+      } else if (!strncmp(argv[x], "--dhcp-subnet-mask=", 19)) {
+        if (sscanf(&argv[x][19], "%hhu.%hhu.%hhu.%hhu", &dhcp_subnet_mask[0],
+            &dhcp_subnet_mask[1], &dhcp_subnet_mask[2], &dhcp_subnet_mask[3]) != 4) {
+          throw invalid_argument("--dhcp-subnet-mask must be 4 decimal bytes");
+        }
+      } else if (!strncmp(argv[x], "--dhcp-lease-time=", 18)) {
+        long lease_seconds = strtol(&argv[x][18], nullptr, 10);
+        if ((lease_seconds <= 0) || (lease_seconds > 0x7FFFFFFF)) {
+          throw invalid_argument("--dhcp-lease-time must be a positive number of seconds");
+        }
+        dhcp_lease_seconds = lease_seconds;
       } else if (!strcmp(argv[x], "--show-data")) {
         show_data = true;
       } else if (!strcmp(argv[x], "--show-size-warnings")) {
@@ -158,10 +228,52 @@ int main(int argc, char** argv) {
     if (!listen_fd.is_open()) {
       throw invalid_argument("--listen must be given");
     }
+    if (client_mtu >= mtu) {
+      client_mtu = 0; // the client can take anything the host sends
+    }
+
+    if (dhcp_pool_start_given || dhcp_pool_size_given) {
+      if (!dhcp_pool_start_given) {
+        throw invalid_argument("--dhcp-pool-size requires --dhcp-pool-start");
+      }
+      if (!dhcp_pool_size_given) {
+        throw invalid_argument("--dhcp-pool-start requires --dhcp-pool-size");
+      }
+      if (dhcp_pool_size <= 0) {
+        throw invalid_argument("--dhcp-pool-size must be greater than 0");
+      }
+
+      auto load_be32 = [](const uint8_t* data) -> uint32_t {
+        return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+      };
+      uint32_t mask = load_be32(dhcp_subnet_mask);
+      uint32_t host_bits = ~mask;
+      if (!mask || (host_bits & (host_bits + 1))) {
+        throw invalid_argument("--dhcp-subnet-mask must be a contiguous, nonzero mask");
+      }
+      // The network and broadcast addresses can't be assigned
+      if (dhcp_pool_size > static_cast<ssize_t>(host_bits) - 1) {
+        throw invalid_argument("--dhcp-pool-size is larger than the subnet");
+      }
+
+      uint32_t network = load_be32(ip_address) & mask;
+      uint64_t pool_start = load_be32(dhcp_pool_start);
+      uint64_t pool_end = pool_start + dhcp_pool_size - 1;
+      if (((pool_start & mask) != network) || (pool_end > 0xFFFFFFFF) ||
+          ((pool_end & mask) != network)) {
+        throw invalid_argument(
+            "the DHCP pool must be inside the subnet of --ip-address and --dhcp-subnet-mask");
+      }
+      if (!(pool_start & host_bits) || ((pool_end & host_bits) == host_bits)) {
+        throw invalid_argument(
+            "the DHCP pool must not include the subnet's network or broadcast address");
+      }
+    }
 
   } catch (const invalid_argument& e) {
     fprintf(stderr, "invalid arguments: %s\n\n", e.what());
     print_usage(stderr, argv[0]);
+    return 1;
   }
 
   // Wait for a client to connect
@@ -193,15 +305,29 @@ int main(int argc, char** argv) {
       metric,
       enable_nud,
       enable_router_advertisements,
-      ifconfig_command);
+      ifconfig_command,
+      dhcp_pool_start_given ? dhcp_subnet_mask : nullptr);
 
   try {
+    LocalResponder responder(
+        mac_address,
+        ip_address,
+        respond_arp,
+        respond_ndp,
+        dhcp_pool_size_given ? dhcp_pool_start : nullptr,
+        dhcp_pool_size,
+        dhcp_subnet_mask,
+        dhcp_lease_seconds);
+
     tap.open();
 
     Poll& poll = tap.get_poll();
     poll.add(client_fd, POLLIN);
 
     string read_buffer;
+    string response;
+    vector<in6_addr> host_ipv6_addresses;
+    time_t host_ipv6_addresses_refresh_time = 0;
     while (!should_exit) {
       auto ready_fds = poll.poll();
 
@@ -213,9 +339,24 @@ int main(int argc, char** argv) {
       if (tap_events & POLLHUP) {
         fprintf(stderr, "tap disconnected\n");
         should_exit = true;
+      } else if ((tap_events & POLLIN) && !show_data && !show_frame_size_warnings) {
+        // Nothing needs to look at the frames, so send them straight from the
+        // interface's receive buffer to the client
+        tap.forward_to_fd(client_fd, use_framed_protocol, client_mtu);
       } else if (tap_events & POLLIN) {
         tap.on_data_available();
+        vector<string> frames;
         for (string frame = tap.recv(0); !frame.empty(); frame = tap.recv(0)) {
+          if (client_mtu) {
+            for (auto& segment : tap.split_frame_for_client(
+                frame.data(), frame.size(), client_mtu)) {
+              frames.emplace_back(std::move(segment));
+            }
+          } else {
+            frames.emplace_back(std::move(frame));
+          }
+        }
+        for (const string& frame : frames) {
           ssize_t computed_size = MacOSNetworkTapInterface::get_frame_size(
               frame.data(), frame.size());
           if (show_frame_size_warnings && (static_cast<size_t>(computed_size) != frame.size())) {
@@ -245,10 +386,32 @@ int main(int argc, char** argv) {
         fprintf(stderr, "client disconnected\n");
         should_exit = true;
       } else if (client_events & POLLIN) {
-        read_buffer += read_all(client_fd);
+        // The host's IPv6 addresses can change after the interface is opened
+        // (for example, when duplicate address detection finishes)
+        if ((client_mtu || respond_ndp) &&
+            (time(nullptr) >= host_ipv6_addresses_refresh_time)) {
+          host_ipv6_addresses = tap.get_ipv6_addresses();
+          host_ipv6_addresses_refresh_time = time(nullptr) + 10;
+          responder.set_ipv6_addresses(host_ipv6_addresses);
+        }
+
+        // Read directly onto the end of the buffer instead of going through a
+        // temporary string
+        size_t prev_size = read_buffer.size();
+        read_buffer.resize(prev_size + 0x10000);
+        ssize_t bytes_read = read(client_fd,
+            const_cast<char*>(read_buffer.data()) + prev_size, 0x10000);
+        if (bytes_read < 0) {
+          throw runtime_error(string_printf("read error from client (%d)", errno));
+        }
+        read_buffer.resize(prev_size + bytes_read);
+        if (bytes_read == 0) {
+          fprintf(stderr, "client disconnected\n");
+          should_exit = true;
+        }
 
         size_t offset;
-        for (offset = 0; offset < read_buffer.size() - 2;) {
+        for (offset = 0; offset + 2 < read_buffer.size();) {
           ssize_t size;
           ssize_t skip_bytes;
           if (use_framed_protocol) {
@@ -284,18 +447,46 @@ int main(int argc, char** argv) {
             break;
           }
 
+          if (client_mtu) {
+            MacOSNetworkTapInterface::raise_tcp_mss(
+                read_buffer.data() + offset + skip_bytes, size, mtu,
+                ip_address, host_ipv6_addresses);
+          }
           if (show_data) {
             fprintf(stderr, "\nFrom tap client:\n");
             print_data(stderr, read_buffer.data() + offset + skip_bytes, size);
           }
-          tap.send(read_buffer.data() + offset + skip_bytes, size);
+
+          // If the local responder handles the frame, it doesn't go to the
+          // interface at all
+          if (responder.is_enabled() && responder.handle_frame(
+              read_buffer.data() + offset + skip_bytes, size, response)) {
+            if (!response.empty()) {
+              if (show_data) {
+                fprintf(stderr, "\nTo tap client (local response):\n");
+                print_data(stderr, response);
+              }
+              if (use_framed_protocol) {
+                uint16_t response_size = response.size();
+                writex(client_fd, &response_size, sizeof(uint16_t));
+              }
+              writex(client_fd, response);
+            }
+          } else {
+            tap.send(read_buffer.data() + offset + skip_bytes, size);
+          }
           offset = end_offset;
         }
 
         // Leave the incomplete frame in the read buffer (if any)
-        read_buffer = read_buffer.substr(offset);
+        read_buffer.erase(0, offset);
       }
     }
+
+    if (client_mtu) {
+      fprintf(stderr, "%zu frames from the host were too large for the client and dropped\n",
+          tap.get_dropped_frame_count());
+    }
   } catch (const exception& e) {
     fprintf(stderr, "error: %s\n", e.what());
     return 3;